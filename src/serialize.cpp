@@ -3,9 +3,15 @@
 //     https://opensource.org/licenses/Apache-2.0
 
 #include "serialize.h"
+#include <capnp/message.h>
 #include <kj/debug.h>
+#include <kj/encoding.h>
+#include <kj/compat/gzip.h>
 #include <kj/string-tree.h>
 #include <kj/vector.h>
+#include <cmath>
+#include <limits>
+#include <string.h>
 
 namespace sqlcap {
 
@@ -15,6 +21,10 @@ static constexpr uint64_t COLUMN_NAME_ANNOTATION_ID = 0xa9bcdb16cc5bbc7full;
 static constexpr uint64_t TABLE_ANNOTATION_ID = 0xb337d975d55c655aull;
 static constexpr uint64_t SCHEMA_ANNOTATION_ID = 0x89ea0152d4a3dae3ull;
 static constexpr uint64_t IGNORE_ANNOTATION_ID = 0xddc3b0b27d076cd1ull;
+static constexpr uint64_t WITHOUT_ROWID_ANNOTATION_ID = 0xe1c3f6a2b48d9057ull;
+static constexpr uint64_t BASE64_ANNOTATION_ID = 0xce3cdc2923dc4341ull;
+static constexpr uint64_t HEX_ANNOTATION_ID = 0x91c5c1f27aad2175ull;
+static constexpr uint64_t COMPRESS_ANNOTATION_ID = 0xc8a4e5d17f3b2960ull;
 
 kj::Maybe<capnp::schema::Value::Reader> getAnnotation(
   capnp::List<capnp::schema::Annotation>::Reader annotations, uint64_t id) {
@@ -83,6 +93,13 @@ kj::StringTree fullName(capnp::StructSchema schema) {
   }
 }
 
+bool isWithoutRowid(capnp::StructSchema schema) {
+  auto proto = schema.getProto();
+  return getAnnotation(proto.getAnnotations(), WITHOUT_ROWID_ANNOTATION_ID).map(
+    [](auto value) { return value.getBool(); }
+  ).orDefault(false);
+}
+
 bool isPrimaryKey(capnp::StructSchema::Field field) {
   auto proto = field.getProto();
    return getAnnotation(proto.getAnnotations(), PRIMARY_KEY_ANNOTATION_ID).map(
@@ -97,11 +114,37 @@ kj::Maybe<kj::StringPtr> annotatedSqlType(capnp::StructSchema::Field field) {
   );
 }
 
+bool isBase64(capnp::StructSchema::Field field) {
+  auto proto = field.getProto();
+  return getAnnotation(proto.getAnnotations(), BASE64_ANNOTATION_ID) != nullptr;
+}
+
+bool isHex(capnp::StructSchema::Field field) {
+  auto proto = field.getProto();
+  return getAnnotation(proto.getAnnotations(), HEX_ANNOTATION_ID) != nullptr;
+}
+
+kj::Maybe<uint32_t> compressThreshold(capnp::StructSchema::Field field) {
+  auto proto = field.getProto();
+  return getAnnotation(proto.getAnnotations(), COMPRESS_ANNOTATION_ID).map(
+    [](auto value) { return value.getUint32(); }
+  );
+}
+
 kj::Maybe<kj::StringPtr> sqlType(capnp::StructSchema::Field field) {
   KJ_IF_MAYBE(s, annotatedSqlType(field)) {
     return *s;
   }
 
+  if (compressThreshold(field) != nullptr && field.getType().isData()) {
+    // Distinguishes columns written in the compressed format from plain BLOB columns.
+    return "COMPRESSED BLOB"_kj;
+  }
+
+  if (isBase64(field) || isHex(field)) {
+    return "TEXT"_kj;
+  }
+
   auto type = field.getType().which();
   using Type = decltype(type);
   switch (type) {
@@ -139,39 +182,6 @@ kj::Maybe<kj::StringPtr> sqlType(capnp::StructSchema::Field field) {
   }
 }
 
-auto pkFields(capnp::StructSchema schema) {
-  kj::Vector<capnp::StructSchema::Field> fields;
-  for (auto&& field: schema.getFields()) {
-    if (isPrimaryKey(field) && !ignoreField(field)) {
-      fields.add(field);
-    }
-  }
-  return fields.releaseAsArray();
-}
-
-auto valueFields(capnp::StructSchema schema) {
-  kj::Vector<capnp::StructSchema::Field> fields;
-  for (auto&& field: schema.getFields()) {
-    if (!isPrimaryKey(field) && !ignoreField(field)) {
-      fields.add(field);
-    }
-  }
-  return fields.releaseAsArray();
-}
-
-kj::Maybe<capnp::StructSchema::Field> fieldByName(capnp::StructSchema schema, kj::StringPtr name) {
-  for (auto&& field: schema.getFields()) {
-    if (ignoreField(field)) {
-      continue;
-    }
-
-    if (name == columnName(field)) {
-      return field;
-    }
-  }
-  return nullptr;
-}
-
 auto fields(capnp::StructSchema schema) {
   kj::Vector<capnp::StructSchema::Field> fields;
   for (auto&& field: schema.getFields()) {
@@ -212,15 +222,46 @@ auto fields(capnp::StructSchema schema) {
   return fields.releaseAsArray();
 }
 
+auto pkFields(capnp::StructSchema schema) {
+  kj::Vector<capnp::StructSchema::Field> pks;
+  for (auto&& field: fields(schema)) {
+    if (isPrimaryKey(field)) {
+      pks.add(field);
+    }
+  }
+  return pks.releaseAsArray();
+}
+
+auto valueFields(capnp::StructSchema schema) {
+  kj::Vector<capnp::StructSchema::Field> values;
+  for (auto&& field: fields(schema)) {
+    if (!isPrimaryKey(field)) {
+      values.add(field);
+    }
+  }
+  return values.releaseAsArray();
+}
+
 kj::String createStatement(capnp::StructSchema schema) {
+  auto pks = pkFields(schema);
+  auto withoutRowid = isWithoutRowid(schema);
+  KJ_REQUIRE(pks.size() > 0 || !withoutRowid,
+    "WITHOUT ROWID table requires a primary key", tableName(schema));
+
   return kj::strTree(
     "CREATE TABLE ", fullName(schema), " (",
     kj::StringTree(KJ_MAP(field, fields(schema)) {
 	auto name = columnName(field);
 	auto type = KJ_REQUIRE_NONNULL(sqlType(field));
-	auto pk = isPrimaryKey(field);
-	return kj::strTree(name, ' ', type, (pk ? " PRIMARY_KEY" : ""));
-      }, ", "), ") "
+	return kj::strTree(name, ' ', type);
+      }, ", "),
+    (pks.size() > 0
+     ? kj::strTree(", PRIMARY KEY (",
+	 kj::StringTree(KJ_MAP(field, pks) {
+	     return kj::strTree(columnName(field));
+	   }, ", "), ")")
+     : kj::strTree()),
+    ")", (withoutRowid ? " WITHOUT ROWID" : "")
   ).flatten();
 }
 
@@ -282,11 +323,340 @@ kj::String selectStatement(capnp::StructSchema schema) {
   ).flatten();
 }
 
+void check(sqlite3* db, int err) {
+  switch (err & 0xff) {
+  case SQLITE_OK:
+  case SQLITE_ROW:
+  case SQLITE_DONE:
+    return;
+  case SQLITE_BUSY:
+  case SQLITE_LOCKED: {
+    // Another connection holds a conflicting lock, so the whole transaction may be retried.
+    auto msg = sqlite3_errmsg(db);
+    throw KJ_EXCEPTION(OVERLOADED, msg);
+  }
+  default: {
+    auto msg = sqlite3_errmsg(db);
+    throw KJ_EXCEPTION(FAILED, msg);
+  }
+  }
+}
+
+bool step(sqlite3* db, sqlite3_stmt* stmt) {
+  auto err = sqlite3_step(stmt);
+  check(db, err);
+  return err == SQLITE_ROW;
+}
+
+void exec(sqlite3* db, kj::StringPtr txt) {
+  check(db, sqlite3_exec(db, txt.cStr(), nullptr, nullptr, nullptr));
+}
+
+kj::Maybe<kj::String> declaredType(
+  sqlite3* db, capnp::StructSchema schema, capnp::StructSchema::Field field) {
+  auto maybeSchema = schemaName(schema);
+  auto txt = kj::str(
+    "SELECT type FROM pragma_table_info(?1", (maybeSchema == nullptr ? "" : ", ?3"),
+    ") WHERE name = ?2");
+
+  sqlite3_stmt* stmt;
+  check(db, sqlite3_prepare_v2(db, txt.cStr(), txt.size(), &stmt, nullptr));
+  KJ_DEFER(sqlite3_finalize(stmt));
+
+  auto table = tableName(schema);
+  auto column = columnName(field);
+  sqlite3_bind_text(stmt, 1, table.begin(), table.size(), SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, column.begin(), column.size(), SQLITE_STATIC);
+  KJ_IF_MAYBE(s, maybeSchema) {
+    sqlite3_bind_text(stmt, 3, s->begin(), s->size(), SQLITE_STATIC);
+  }
+
+  if (!step(db, stmt)) {
+    return nullptr;
+  }
+  return kj::str(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+}
+
+class MallocOutputStream final: public kj::OutputStream {
+  // Collects output in a malloc()ed buffer, which bind() hands to SQLite without another copy.
+
+public:
+  explicit MallocOutputStream(size_t capacity)
+    : data_{static_cast<kj::byte*>(malloc(kj::max(capacity, size_t(1))))}
+    , capacity_{kj::max(capacity, size_t(1))} {
+    KJ_ASSERT(data_ != nullptr, "out of memory");
+  }
+  KJ_DISALLOW_COPY(MallocOutputStream);
+
+  ~MallocOutputStream() noexcept(false) {
+    free(data_);
+  }
+
+  void write(const void* buffer, size_t size) override {
+    if (size_ + size > capacity_) {
+      auto capacity = kj::max(capacity_ * 2, size_ + size);
+      auto data = static_cast<kj::byte*>(realloc(data_, capacity));
+      KJ_ASSERT(data != nullptr, "out of memory");
+      data_ = data;
+      capacity_ = capacity;
+    }
+    memcpy(data_ + size_, buffer, size);
+    size_ += size;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  void bind(sqlite3_stmt* stmt, int param) {
+    // SQLite frees the buffer when done with it, even if binding fails.
+    auto data = data_;
+    data_ = nullptr;
+    sqlite3_bind_blob64(stmt, param, data, size_, free);
+  }
+
+private:
+  kj::byte* data_;
+  size_t capacity_;
+  size_t size_ = 0;
+};
+
+// Per-type codecs, indexed by capnp::schema::Type::Which so that encode() and decode() dispatch
+// with a single table lookup.
+
+using EncodeFn = void (*)(capnp::DynamicValue::Reader, sqlite3_stmt*, int);
+using DecodeFn = capnp::Orphan<capnp::DynamicValue> (*)(
+  capnp::Type, sqlite3_stmt*, int col, int colType, capnp::Orphanage);
+
+struct Codec {
+  EncodeFn encode;
+  DecodeFn decode;
+};
+
+void encodeNull(capnp::DynamicValue::Reader, sqlite3_stmt* stmt, int param) {
+  sqlite3_bind_null(stmt, param);
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeNull(
+  capnp::Type, sqlite3_stmt*, int, int, capnp::Orphanage) {
+  return capnp::VOID;
+}
+
+void encodeBool(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  sqlite3_bind_int(stmt, param, input.as<bool>() ? 1 : 0);
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeBool(
+  capnp::Type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage) {
+  KJ_REQUIRE(colType == SQLITE_INTEGER);
+  return sqlite3_column_int(stmt, col) ? true : false;
+}
+
+template <typename T>
+void encodeInt(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  // as<T>() throws if the value does not fit.  UInt64 is stored as its two's complement bit
+  // pattern, since SQLite integers are signed 64-bit.
+  sqlite3_bind_int64(stmt, param, static_cast<int64_t>(input.as<T>()));
+}
+
+template <typename T>
+capnp::Orphan<capnp::DynamicValue> decodeInt(
+  capnp::Type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage) {
+  KJ_REQUIRE(colType == SQLITE_INTEGER);
+  auto value = sqlite3_column_int64(stmt, col);
+  if constexpr (sizeof(T) < sizeof(int64_t)) {
+    KJ_REQUIRE(value >= static_cast<int64_t>(std::numeric_limits<T>::min()) &&
+	       value <= static_cast<int64_t>(std::numeric_limits<T>::max()),
+	       "integer column value out of range for field type", value);
+  }
+  return static_cast<T>(value);
+}
+
+void encodeEnum(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  sqlite3_bind_int(stmt, param, input.as<capnp::DynamicEnum>().getRaw());
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeEnum(
+  capnp::Type type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage) {
+  KJ_REQUIRE(colType == SQLITE_INTEGER);
+  auto value = sqlite3_column_int64(stmt, col);
+  KJ_REQUIRE(value >= 0 && value <= std::numeric_limits<uint16_t>::max(),
+	     "enum column value out of range", value);
+  return capnp::DynamicEnum(type.asEnum(), static_cast<uint16_t>(value));
+}
+
+void encodeFloat(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  // SQLite has no NaN: it stores one as NULL, which decodes as the field's default of 0.
+  sqlite3_bind_double(stmt, param, input.as<double>());
+}
+
+template <typename T>
+capnp::Orphan<capnp::DynamicValue> decodeFloat(
+  capnp::Type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage) {
+  KJ_REQUIRE(colType == SQLITE_FLOAT || colType == SQLITE_INTEGER);
+  auto value = sqlite3_column_double(stmt, col);
+  if constexpr (sizeof(T) < sizeof(double)) {
+    KJ_REQUIRE(std::isnan(value) || std::isinf(value) ||
+	       std::fabs(value) <= std::numeric_limits<T>::max(),
+	       "real column value out of range for field type", value);
+  }
+  return static_cast<T>(value);
+}
+
+void encodeText(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  auto txt = input.as<capnp::Text>();
+  sqlite3_bind_text(stmt, param, txt.cStr(), txt.size(), SQLITE_TRANSIENT);
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeText(
+  capnp::Type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage orphanage) {
+  KJ_REQUIRE(colType == SQLITE_TEXT);
+  auto txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+  auto len = sqlite3_column_bytes(stmt, col);
+  KJ_REQUIRE(len >= 0);
+  return orphanage.newOrphanCopy(capnp::Text::Reader{txt, static_cast<size_t>(len)});
+}
+
+void encodeData(capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) {
+  auto data = input.as<capnp::Data>();
+  sqlite3_bind_blob(stmt, param, data.begin(), data.size(), SQLITE_TRANSIENT);
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeData(
+  capnp::Type, sqlite3_stmt* stmt, int col, int colType, capnp::Orphanage orphanage) {
+  KJ_REQUIRE(colType == SQLITE_BLOB);
+  auto data = reinterpret_cast<const kj::byte*>(sqlite3_column_blob(stmt, col));
+  auto len = sqlite3_column_bytes(stmt, col);
+  KJ_REQUIRE(len >= 0);
+  return orphanage.newOrphanCopy(capnp::Data::Reader{data, static_cast<size_t>(len)});
+}
+
+struct CodecTable {
+  static constexpr size_t SIZE = static_cast<size_t>(capnp::schema::Type::ANY_POINTER) + 1;
+
+  constexpr CodecTable() {
+    using Type = capnp::schema::Type::Which;
+
+    for (auto& codec: codecs) {
+      codec = {encodeNull, decodeNull};
+    }
+    set(Type::BOOL, encodeBool, decodeBool);
+    set(Type::INT8, encodeInt<int8_t>, decodeInt<int8_t>);
+    set(Type::INT16, encodeInt<int16_t>, decodeInt<int16_t>);
+    set(Type::INT32, encodeInt<int32_t>, decodeInt<int32_t>);
+    set(Type::INT64, encodeInt<int64_t>, decodeInt<int64_t>);
+    set(Type::UINT8, encodeInt<uint8_t>, decodeInt<uint8_t>);
+    set(Type::UINT16, encodeInt<uint16_t>, decodeInt<uint16_t>);
+    set(Type::UINT32, encodeInt<uint32_t>, decodeInt<uint32_t>);
+    set(Type::UINT64, encodeInt<uint64_t>, decodeInt<uint64_t>);
+    set(Type::FLOAT32, encodeFloat, decodeFloat<float>);
+    set(Type::FLOAT64, encodeFloat, decodeFloat<double>);
+    set(Type::TEXT, encodeText, decodeText);
+    set(Type::DATA, encodeData, decodeData);
+    set(Type::ENUM, encodeEnum, decodeEnum);
+  }
+
+  const Codec& operator[](capnp::schema::Type::Which which) const {
+    auto ii = static_cast<size_t>(which);
+    KJ_DASSERT(ii < SIZE);
+    return codecs[ii];
+  }
+
+private:
+  Codec codecs[SIZE] = {};
+
+  constexpr void set(capnp::schema::Type::Which which, EncodeFn encode, DecodeFn decode) {
+    codecs[static_cast<size_t>(which)] = {encode, decode};
+  }
+};
+
+constexpr CodecTable CODECS;
+
+void encodeValue(capnp::DynamicValue::Reader input, capnp::Type type, sqlite3_stmt* stmt, int param) {
+  CODECS[type.which()].encode(input, stmt, param);
+}
+
+capnp::Orphan<capnp::DynamicValue> decodeValue(
+  capnp::Type type, sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) {
+  auto colType = sqlite3_column_type(stmt, col);
+  if (colType == SQLITE_NULL) {
+    return capnp::VOID;
+  }
+  return CODECS[type.which()].decode(type, stmt, col, colType, orphanage);
+}
+
+kj::String scanStatement(capnp::StructSchema schema, uint prefix) {
+  auto pks = pkFields(schema);
+  KJ_REQUIRE(prefix <= pks.size(), "scan prefix is longer than the primary key");
+
+  return kj::strTree(
+    "SELECT ",
+    kj::StringTree(KJ_MAP(field, fields(schema)) {
+	auto name = columnName(field);
+	return kj::strTree(name);
+      }, ", "),
+    " FROM ", fullName(schema),
+    (prefix > 0
+     ? kj::strTree(" WHERE ",
+	 kj::StringTree(KJ_MAP(field, pks.slice(0, prefix)) {
+	     auto name = columnName(field);
+	     return kj::strTree(name, " = ?", paramIndex(field));
+	   }, " AND "))
+     : kj::strTree()),
+    (pks.size() > 0
+     ? kj::strTree(" ORDER BY ",
+	 kj::StringTree(KJ_MAP(field, pks) {
+	     return kj::strTree(columnName(field));
+	   }, ", "))
+     : kj::strTree())
+  ).flatten();
+}
+
 struct Adapter::Impl {
   
   Impl(sqlite3* db, capnp::StructSchema schema)
     : db_{db}
-    , schema_{schema} {
+    , schema_{schema}
+    , columns_{KJ_MAP(field, fields(schema)) {
+	return Column{field, static_cast<int>(paramIndex(field)), CODECS[field.getType().which()]};
+      }}
+    , pkColumns_{columnsWhere(true)}
+    , valueColumns_{columnsWhere(false)}
+    , columnsByField_{kj::heapArray<Column*>(schema.getFields().size())}
+    , scanStatements_{kj::heapArray<sqlite3_stmt*>(pkColumns_.size() + 1)} {
+
+    for (auto& stmt: scanStatements_) {
+      stmt = nullptr;
+    }
+
+    for (auto& column: columnsByField_) {
+      column = nullptr;
+    }
+    for (auto& column: columns_) {
+      columnsByField_[column.field.getIndex()] = &column;
+    }
+
+    for (auto& column: columns_) {
+      KJ_IF_MAYBE(threshold, compressThreshold(column.field)) {
+	auto type = column.field.getType();
+	auto name = column.field.getProto().getName();
+	KJ_REQUIRE(type.isText() || type.isData(),
+	  "compress annotation applies only to Text and Data fields", name);
+	KJ_REQUIRE(!isPrimaryKey(column.field),
+	  "compress annotation cannot be used on primary key fields", name);
+	if (type.isData()) {
+	  KJ_REQUIRE(annotatedSqlType(column.field) == nullptr,
+	    "compressed Data fields cannot have an sqliteType annotation", name);
+	  KJ_IF_MAYBE(declared, declaredType(db_, schema_, column.field)) {
+	    KJ_REQUIRE(*declared == "COMPRESSED BLOB",
+	      "cannot compress an existing Data column in place; copy its rows into a new table",
+	      name, *declared);
+	  }
+	}
+	compressors_.insert(column.field.getIndex(), kj::heap<CompressHandler>(*threshold));
+      }
+    }
+    resolveHandlers();
 
     auto flags =  SQLITE_PREPARE_PERSISTENT;
     
@@ -318,11 +688,288 @@ struct Adapter::Impl {
     sqlite3_finalize(updateStatement_);
     sqlite3_finalize(deleteStatement_);
     sqlite3_finalize(selectStatement_);
+    for (auto stmt: scanStatements_) {
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  sqlite3_stmt* scanStatement(uint prefix) {
+    auto& stmt = scanStatements_[prefix];
+    if (stmt == nullptr) {
+      // Prepared lazily, as most callers only ever scan on one or two prefix lengths.
+      auto txt = sqlcap::scanStatement(schema_, prefix);
+      check(db_, sqlite3_prepare_v3(db_, txt.cStr(), txt.size(), SQLITE_PREPARE_PERSISTENT, &stmt, nullptr));
+    }
+    return stmt;
   }
 
 private:
+  struct Column {
+    capnp::StructSchema::Field field;
+    int param;
+    Codec codec;
+    const HandlerBase* handler = nullptr;
+    // Resolved from fieldHandlers_, then the field's annotations, then typeHandlers_.  When null,
+    // `codec` is used.
+  };
+
+  struct Base64Handler: HandlerBase {
+    void encodeBase(
+      const Adapter&, capnp::DynamicValue::Reader input,
+      sqlite3_stmt* stmt, int param) const override {
+      auto txt = kj::encodeBase64(input.as<capnp::Data>());
+      sqlite3_bind_text(stmt, param, txt.cStr(), txt.size(), SQLITE_TRANSIENT);
+    }
+
+    capnp::Orphan<capnp::DynamicValue> decodeBase(
+      const Adapter&, capnp::Type,
+      sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) const override {
+      auto data = kj::decodeBase64(columnText(stmt, col));
+      KJ_REQUIRE(!data.hadErrors, "invalid base64 column value");
+      return orphanage.newOrphanCopy(capnp::Data::Reader{data.begin(), data.size()});
+    }
+  };
+
+  struct HexHandler: HandlerBase {
+    void encodeBase(
+      const Adapter&, capnp::DynamicValue::Reader input,
+      sqlite3_stmt* stmt, int param) const override {
+      auto txt = kj::encodeHex(input.as<capnp::Data>());
+      sqlite3_bind_text(stmt, param, txt.cStr(), txt.size(), SQLITE_TRANSIENT);
+    }
+
+    capnp::Orphan<capnp::DynamicValue> decodeBase(
+      const Adapter&, capnp::Type,
+      sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) const override {
+      auto data = kj::decodeHex(columnText(stmt, col));
+      KJ_REQUIRE(!data.hadErrors, "invalid hex column value");
+      return orphanage.newOrphanCopy(capnp::Data::Reader{data.begin(), data.size()});
+    }
+  };
+
+  struct CompressHandler: HandlerBase {
+    // Text is stored as TEXT when uncompressed, exactly as without the annotation, and as a BLOB
+    // holding the uncompressed size (a little-endian u32) and then the gzip stream when
+    // compressed.
+    //
+    // Data is stored in a COMPRESSED BLOB column as a format byte, followed either by the raw
+    // value or by the uncompressed size and the gzip stream.
+    //
+    // The recorded size bounds decompression, and lets it inflate straight into the message.
+
+    static constexpr kj::byte RAW = 0;
+    static constexpr kj::byte GZIP = 1;
+
+    explicit CompressHandler(uint32_t threshold)
+      : threshold_{threshold} {
+    }
+
+    void encodeBase(
+      const Adapter&, capnp::DynamicValue::Reader input,
+      sqlite3_stmt* stmt, int param) const override {
+      auto isText = input.getType() == capnp::DynamicValue::TEXT;
+      kj::ArrayPtr<const kj::byte> bytes;
+      if (isText) {
+	bytes = input.as<capnp::Text>().asBytes();
+      }
+      else {
+	bytes = input.as<capnp::Data>();
+      }
+      auto rawSize = bytes.size() + (isText ? 0 : 1);
+
+      if (bytes.size() >= threshold_ && bytes.size() <= std::numeric_limits<uint32_t>::max()) {
+	MallocOutputStream out{bytes.size() / 2 + 32};
+	if (!isText) {
+	  out.write(&GZIP, 1);
+	}
+	writeSize(out, bytes.size());
+	{
+	  kj::GzipOutputStream gzip{out};
+	  gzip.write(bytes.begin(), bytes.size());
+	}
+
+	if (out.size() < rawSize) {
+	  out.bind(stmt, param);
+	  return;
+	}
+      }
+
+      if (isText) {
+	auto txt = input.as<capnp::Text>();
+	sqlite3_bind_text(stmt, param, txt.cStr(), txt.size(), SQLITE_TRANSIENT);
+      }
+      else {
+	MallocOutputStream out{rawSize};
+	out.write(&RAW, 1);
+	out.write(bytes.begin(), bytes.size());
+	out.bind(stmt, param);
+      }
+    }
+
+    capnp::Orphan<capnp::DynamicValue> decodeBase(
+      const Adapter&, capnp::Type type,
+      sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) const override {
+      auto colType = sqlite3_column_type(stmt, col);
+
+      if (type.isText()) {
+	if (colType == SQLITE_TEXT) {
+	  auto txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+	  auto len = sqlite3_column_bytes(stmt, col);
+	  return orphanage.newOrphanCopy(capnp::Text::Reader{txt, static_cast<size_t>(len)});
+	}
+	KJ_REQUIRE(colType == SQLITE_BLOB, "unexpected value in compressed Text column");
+	return inflate<capnp::Text>(stmt, columnBlob(stmt, col), orphanage);
+      }
+
+      KJ_REQUIRE(colType == SQLITE_BLOB, "unexpected value in compressed Data column");
+      auto blob = columnBlob(stmt, col);
+      KJ_REQUIRE(blob.size() >= 1, "compressed column value is missing its format byte");
+      auto payload = blob.slice(1, blob.size());
+      switch (blob[0]) {
+      case RAW:
+	return orphanage.newOrphanCopy(capnp::Data::Reader{payload.begin(), payload.size()});
+      case GZIP:
+	return inflate<capnp::Data>(stmt, payload, orphanage);
+      default:
+	KJ_FAIL_REQUIRE("unknown compressed column format", blob[0]);
+      }
+    }
+
+  private:
+    uint32_t threshold_;
+
+    static void writeSize(kj::OutputStream& out, size_t size) {
+      kj::byte bytes[sizeof(uint32_t)];
+      for (size_t ii = 0; ii < sizeof(uint32_t); ++ii) {
+	bytes[ii] = static_cast<kj::byte>(size >> (8 * ii));
+      }
+      out.write(bytes, sizeof(bytes));
+    }
+
+    static kj::ArrayPtr<const kj::byte> columnBlob(sqlite3_stmt* stmt, int col) {
+      auto begin = reinterpret_cast<const kj::byte*>(sqlite3_column_blob(stmt, col));
+      auto len = sqlite3_column_bytes(stmt, col);
+      return kj::arrayPtr(begin, static_cast<size_t>(len));
+    }
+
+    template <typename T>
+    static capnp::Orphan<capnp::DynamicValue> inflate(
+      sqlite3_stmt* stmt, kj::ArrayPtr<const kj::byte> payload, capnp::Orphanage orphanage) {
+      KJ_REQUIRE(payload.size() >= sizeof(uint32_t), "compressed column value is missing its size");
+      size_t size = 0;
+      for (size_t ii = 0; ii < sizeof(uint32_t); ++ii) {
+	size |= static_cast<size_t>(payload[ii]) << (8 * ii);
+      }
+      auto limit = sqlite3_limit(sqlite3_db_handle(stmt), SQLITE_LIMIT_LENGTH, -1);
+      KJ_REQUIRE(size <= static_cast<size_t>(limit), "compressed column value is too large", size);
+
+      kj::ArrayInputStream in{payload.slice(sizeof(uint32_t), payload.size())};
+      kj::GzipInputStream gzip{in};
+      auto result = orphanage.newOrphan<T>(size);
+      gzip.read(result.get().begin(), size);
+      kj::byte extra;
+      KJ_REQUIRE(gzip.tryRead(&extra, 1, 1) == 0, "compressed column value is longer than its size");
+      return kj::mv(result);
+    }
+  };
+
+  static kj::StringPtr columnText(sqlite3_stmt* stmt, int col) {
+    auto txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+    auto len = sqlite3_column_bytes(stmt, col);
+    KJ_REQUIRE(len >= 0);
+    return kj::StringPtr{txt, static_cast<size_t>(len)};
+  }
+
+  kj::Array<Column*> columnsWhere(bool pk) {
+    kj::Vector<Column*> result;
+    for (auto& column: columns_) {
+      if (isPrimaryKey(column.field) == pk) {
+	result.add(&column);
+      }
+    }
+    return result.releaseAsArray();
+  }
+
+  void resolveHandlers() {
+    for (auto& column: columns_) {
+      column.handler = resolveHandler(column.field);
+    }
+  }
+
+  const HandlerBase* resolveHandler(capnp::StructSchema::Field field) const {
+    KJ_IF_MAYBE(handler, fieldHandlers_.find(field)) {
+      return *handler;
+    }
+
+    // Annotations fix the column's SQL type and stored format, so type handlers must not
+    // override them.
+    auto base64 = isBase64(field);
+    auto hex = isHex(field);
+
+    KJ_IF_MAYBE(compressor, compressors_.find(field.getIndex())) {
+      KJ_REQUIRE(!base64 && !hex,
+	"field cannot be both compressed and base64 or hex", field.getProto().getName());
+      return compressor->get();
+    }
+
+    if (base64 || hex) {
+      auto name = field.getProto().getName();
+      KJ_REQUIRE(field.getType().isData(), "base64 and hex annotations apply only to Data fields", name);
+      KJ_REQUIRE(!(base64 && hex), "field cannot be both base64 and hex", name);
+      return base64 ? static_cast<const HandlerBase*>(&base64_) : &hex_;
+    }
+
+    KJ_IF_MAYBE(handler, typeHandlers_.find(field.getType())) {
+      return *handler;
+    }
+    return nullptr;
+  }
+
+  void encode(
+    const Adapter& adapter, const Column& column,
+    capnp::DynamicValue::Reader input, sqlite3_stmt* stmt) const {
+    encode(adapter, column, input, stmt, column.param);
+  }
+
+  void encode(
+    const Adapter& adapter, const Column& column,
+    capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) const {
+    if (column.handler != nullptr) {
+      column.handler->encodeBase(adapter, input, stmt, param);
+    }
+    else {
+      column.codec.encode(input, stmt, param);
+    }
+  }
+
+  const Column& columnFor(capnp::StructSchema::Field field) const {
+    KJ_REQUIRE(field.getContainingStruct() == schema_, "field belongs to a different struct",
+      field.getProto().getName());
+    auto column = columnsByField_[field.getIndex()];
+    KJ_REQUIRE(column != nullptr, "field has no column", field.getProto().getName());
+    return *column;
+  }
+
+  capnp::Orphan<capnp::DynamicValue> decode(
+    const Adapter& adapter, const Column& column,
+    sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) const {
+    auto colType = sqlite3_column_type(stmt, col);
+    if (colType == SQLITE_NULL) {
+      return capnp::VOID;
+    }
+
+    auto type = column.field.getType();
+    if (column.handler != nullptr) {
+      return column.handler->decodeBase(adapter, type, stmt, col, orphanage);
+    }
+    return column.codec.decode(type, stmt, col, colType, orphanage);
+  }
+
   kj::HashMap<capnp::StructSchema::Field, HandlerBase*> fieldHandlers_;
   kj::HashMap<capnp::Type, HandlerBase*> typeHandlers_;
+  Base64Handler base64_;
+  HexHandler hex_;
+  kj::HashMap<uint, kj::Own<CompressHandler>> compressors_;
 
   sqlite3* db_;
   capnp::StructSchema schema_;
@@ -332,6 +979,17 @@ private:
   sqlite3_stmt* deleteStatement_;
   sqlite3_stmt* selectStatement_;
 
+  // Columns in the order they appear in createStatement() and scanStatement().
+  kj::Array<Column> columns_;
+  // Subsets of columns_ in the order of the key and value columns of the other statements.
+  kj::Array<Column*> pkColumns_;
+  kj::Array<Column*> valueColumns_;
+  // Indexed by field index; null for fields without a column.
+  kj::Array<Column*> columnsByField_;
+
+  // Indexed by primary key prefix length.
+  kj::Array<sqlite3_stmt*> scanStatements_;
+
   friend class Adapter;
 };
 
@@ -344,100 +1002,91 @@ Adapter::~Adapter() {
 }
 
 void Adapter::insert(capnp::DynamicStruct::Reader input) {
-  sqlite3_clear_bindings(impl_->insertStatement_);
+  auto stmt = impl_->insertStatement_;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
 
-  for (auto field: impl_->schema_.getFields()) {
-    if (ignoreField(field)) {
-      continue;
-    }
-
-    auto value = input.get(field);
-    auto type = field.getType();
-    auto name = field.getProto().getName();
-    auto index = paramIndex(field); 
-    KJ_LOG(INFO, "Encoding", index, value, name);
-    encode(value, type, impl_->insertStatement_, index);
-  }
-  
- repeat:
-  int step = sqlite3_step(impl_->insertStatement_);
-  if (step == SQLITE_DONE) {
-    return;
+  for (auto& column: impl_->columns_) {
+    impl_->encode(*this, column, input.get(column.field), stmt);
   }
 
-  if (step == SQLITE_ROW) {
-    return;
-  }
-
-  if (step == SQLITE_ERROR) {
-    auto msg = sqlite3_errmsg(impl_->db_);
-    throw KJ_EXCEPTION(FAILED, msg);
+  while (step(impl_->db_, stmt)) {
   }
-
-  throw KJ_EXCEPTION(UNIMPLEMENTED);
 }
 
 void Adapter::update(capnp::DynamicStruct::Reader input) {
-  for (auto field: impl_->schema_.getFields()) {
-    if (ignoreField(field)) {
-      continue;
-    }
+  auto stmt = impl_->updateStatement_;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
 
-    auto value = input.get(field);
-    auto type = field.getType();
-    
-    encode(value, type, impl_->updateStatement_, paramIndex(field));
+  for (auto& column: impl_->columns_) {
+    impl_->encode(*this, column, input.get(column.field), stmt);
+  }
+
+  while (step(impl_->db_, stmt)) {
   }
 }
 
 void Adapter::select(capnp::DynamicStruct::Builder builder) {
   auto orphanage = capnp::Orphanage::getForMessageContaining(builder);
+  auto stmt = impl_->selectStatement_;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  // Release the read lock even if decoding throws.
+  KJ_DEFER(sqlite3_reset(stmt));
+
+  for (auto column: impl_->pkColumns_) {
+    impl_->encode(*this, *column, builder.asReader().get(column->field), stmt);
+  }
 
-  for (auto field: impl_->schema_.getFields()) {
-    if (ignoreField(field)) {
-      continue;
-    }
-
-    if (!isPrimaryKey(field)) {
-      continue;
+  while (step(impl_->db_, stmt)) {
+    // Result columns are in the same order as valueColumns_.
+    for (auto ii: kj::indices(impl_->valueColumns_)) {
+      auto& column = *impl_->valueColumns_[ii];
+      auto value = impl_->decode(*this, column, stmt, ii, orphanage);
+      if (value.getType() != capnp::DynamicValue::VOID) {
+	builder.adopt(column.field, kj::mv(value));
+      }
     }
-    auto value = builder.get(field);
-    auto type = field.getType();
-    
-    auto name = field.getProto().getName();
-    auto index = paramIndex(field);
-    encode(value.asReader(), type, impl_->selectStatement_, index);
   }
+}
 
- repeat:
-  int step = sqlite3_step(impl_->selectStatement_);
-  if (step == SQLITE_DONE) {
-    return;
+void Adapter::scan(
+  capnp::DynamicStruct::Reader key, uint prefix,
+  kj::FunctionParam<void(capnp::DynamicStruct::Reader)> func) {
+  KJ_REQUIRE(prefix <= impl_->pkColumns_.size(), "scan prefix is longer than the primary key");
+
+  auto stmt = impl_->scanStatement(prefix);
+  KJ_REQUIRE(!sqlite3_stmt_busy(stmt),
+    "scan() cannot be nested inside another scan() with the same prefix");
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  // Release the read lock even if decoding or `func` throws.
+  KJ_DEFER(sqlite3_reset(stmt));
+
+  for (auto column: impl_->pkColumns_.slice(0, prefix)) {
+    impl_->encode(*this, *column, key.get(column->field), stmt);
   }
 
-  if (step == SQLITE_ROW) {
-    auto len = sqlite3_column_count(impl_->selectStatement_);
-    for (auto ii = 0; ii < len; ++ii) {
-      auto name = sqlite3_column_name(impl_->selectStatement_, ii);
-
-      KJ_IF_MAYBE(field, fieldByName(impl_->schema_, name)) {
-	auto type = field->getType();
-	auto value = decode(type, impl_->selectStatement_, ii, orphanage);
-	if (value.getType() != capnp::DynamicValue::VOID) {
-	  builder.adopt(*field, kj::mv(value));
-	}
+  // Rows are built in a stack buffer, which MallocMessageBuilder zeroes again on destruction, so
+  // only rows that outgrow it allocate.
+  capnp::word scratch[256] = {};
+
+  while (step(impl_->db_, stmt)) {
+    capnp::MallocMessageBuilder mb{kj::arrayPtr(scratch, kj::size(scratch))};
+    auto row = mb.initRoot<capnp::DynamicStruct>(impl_->schema_);
+    auto orphanage = mb.getOrphanage();
+
+    // Result columns are in the same order as columns_.
+    for (auto ii: kj::indices(impl_->columns_)) {
+      auto& column = impl_->columns_[ii];
+      auto value = impl_->decode(*this, column, stmt, ii, orphanage);
+      if (value.getType() != capnp::DynamicValue::VOID) {
+	row.adopt(column.field, kj::mv(value));
       }
     }
-    goto repeat;
+    func(row.asReader());
   }
- 
-  if (step == SQLITE_ERROR) {
-    auto msg = sqlite3_errmsg(impl_->db_);
-    throw KJ_EXCEPTION(FAILED, msg);
-  }
-
-  throw KJ_EXCEPTION(UNIMPLEMENTED);
-  
 }
 
 void Adapter::encode(capnp::DynamicValue::Reader input, capnp::Type type, sqlite3_stmt* stmt, int param) const {
@@ -445,107 +1094,81 @@ void Adapter::encode(capnp::DynamicValue::Reader input, capnp::Type type, sqlite
     return (*handler)->encodeBase(*this, input, stmt, param);
   }
 
-  auto which = type.which();
-  using Type = decltype(which);
-  
-  switch (which) {
-  case Type::BOOL:
-    sqlite3_bind_int(stmt, param, input.as<bool>() ? 1 : 0);
-    break;
-  case Type::ENUM:
-    sqlite3_bind_int(stmt, param, input.as<capnp::DynamicEnum>().getRaw());
-    break;
-  case Type::INT64:
-    sqlite3_bind_int64(stmt, param, input.as<int64_t>());
-    break;
-  case Type::UINT64:
-    sqlite3_bind_int64(stmt, param, input.as<uint64_t>());
-    break;
-  case Type::FLOAT32:
-    sqlite3_bind_double(stmt, param, input.as<float>());
-    break;
-  case Type::FLOAT64:	
-    sqlite3_bind_double(stmt, param, input.as<float>());
-    break;
-  case Type::TEXT: {
-    auto txt = input.as<capnp::Text>();
-    sqlite3_bind_text(stmt, param, txt.cStr(), txt.size(), SQLITE_TRANSIENT);
-    break;
-  }
-  case Type::DATA: {
-    auto data = input.as<capnp::Data>();
-    sqlite3_bind_blob(stmt, param, data.begin(), data.size(), SQLITE_TRANSIENT);
-    break;
-  }
-  }
+  encodeValue(input, type, stmt, param);
 }
 
 capnp::Orphan<capnp::DynamicValue> Adapter::decode(capnp::Type type, sqlite3_stmt* stmt, int col, capnp::Orphanage orphanage) const {
-  KJ_IF_MAYBE(handler, impl_->typeHandlers_.find(type)) {
-    return (*handler)->decodeBase(*this, stmt, col, orphanage);
-  }
-
   auto colType = sqlite3_column_type(stmt, col);
   if (colType == SQLITE_NULL) {
     return capnp::VOID;
   }
 
-  auto which = type.which();
-  using Type = decltype(which);
-  
-  switch (which) {
-  case Type::BOOL:
-    KJ_REQUIRE(colType == SQLITE_INTEGER);
-    return sqlite3_column_int(stmt, col) ? true : false;
-  case Type::ENUM:
-    KJ_REQUIRE(colType == SQLITE_INTEGER);
-    return static_cast<uint16_t>(sqlite3_column_int(stmt, col));
-  case Type::INT64:
-    KJ_REQUIRE(colType == SQLITE_INTEGER);
-    return sqlite3_column_int64(stmt, col);
-  case Type::UINT64:
-    KJ_REQUIRE(colType == SQLITE_INTEGER);
-    return static_cast<uint64_t>(sqlite3_column_int64(stmt, col));
-  case Type::FLOAT32:
-    KJ_REQUIRE(colType == SQLITE_FLOAT);
-    return static_cast<float>(sqlite3_column_double(stmt, col));
-  case Type::FLOAT64:
-    KJ_REQUIRE(colType == SQLITE_FLOAT);
-    return sqlite3_column_double(stmt, col);	
-  case Type::TEXT: {
-    KJ_REQUIRE(colType == SQLITE_TEXT);
-    auto len = sqlite3_column_bytes(stmt, col);
-    KJ_REQUIRE(len >= 0);
-    auto txt = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
-    return orphanage.newOrphanCopy(capnp::Text::Reader{txt, static_cast<size_t>(len)});
-  }
-  case Type::DATA: {
-    KJ_REQUIRE(colType == SQLITE_BLOB);
-    auto len = sqlite3_column_bytes(stmt, col);
-    KJ_REQUIRE(len >= 0);
-    auto data = reinterpret_cast<const kj::byte*>(sqlite3_column_blob(stmt, col));
-    return orphanage.newOrphanCopy(capnp::Data::Reader{data, static_cast<size_t>(len)});
-  }
+  KJ_IF_MAYBE(handler, impl_->typeHandlers_.find(type)) {
+    return (*handler)->decodeBase(*this, type, stmt, col, orphanage);
   }
-  return capnp::VOID;
+
+  return decodeValue(type, stmt, col, orphanage);
 }
 
 void Adapter::encodeField(capnp::StructSchema::Field field, capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) const {
-  KJ_IF_MAYBE(handler, impl_->fieldHandlers_.find(field)) {
-    return (*handler)->encodeBase(*this, input, stmt, param);
-  }
-
-  return encode(input, field.getType(), stmt, param);
+  impl_->encode(*this, impl_->columnFor(field), input, stmt, param);
 }
 
 void Adapter::addFieldHandlerImpl(
   capnp::StructSchema::Field field, capnp::Type type, HandlerBase& handler) {
+  KJ_REQUIRE(field.getContainingStruct() == impl_->schema_ && !ignoreField(field),
+    "addFieldHandler() field is not a column of this Adapter's struct", field.getProto().getName());
   KJ_REQUIRE(type == field.getType(),
     "handler type did not match field type for addFieldHandler()");
   impl_->fieldHandlers_.upsert(field, &handler, [](HandlerBase*& existing, HandlerBase* replacement) {
     KJ_REQUIRE(existing == replacement, "field already has a different registered handler");
   });  
+  impl_->resolveHandlers();
+}
+
+void Adapter::addTypeHandlerImpl(capnp::Type type, HandlerBase& handler) {
+  impl_->typeHandlers_.upsert(type, &handler, [](HandlerBase*& existing, HandlerBase* replacement) {
+    KJ_REQUIRE(existing == replacement, "type already has a different registered handler");
+  });
+  impl_->resolveHandlers();
+}
+
+Transaction::Transaction(sqlite3* db)
+  : db_{db} {
+  exec(db_, "SAVEPOINT sqlcap");
+}
+
+Transaction::~Transaction() noexcept {
+  if (done_) {
+    return;
+  }
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([this]() {
+    rollback();
+  })) {
+    KJ_LOG(ERROR, "failed to roll back transaction", *exception);
+  }
 }
 
+void Transaction::commit() {
+  KJ_REQUIRE(!done_, "transaction already finished");
+  exec(db_, "RELEASE sqlcap");
+  done_ = true;
+}
+
+void Transaction::rollback() {
+  KJ_REQUIRE(!done_, "transaction already finished");
+  done_ = true;
+  exec(db_, "ROLLBACK TO sqlcap; RELEASE sqlcap");
+}
+
+void Transaction::backoff(uint attempt) {
+  // Exponential, capped at a quarter second per attempt, and jittered to somewhere in the upper
+  // half of the delay so that contending connections do not retry in lockstep.
+  auto delay = kj::min(1u << kj::min(attempt, 8u), 256u);
+  uint jitter;
+  sqlite3_randomness(sizeof(jitter), &jitter);
+  sqlite3_sleep(delay / 2 + jitter % (delay / 2 + 1));
+}
 
 }
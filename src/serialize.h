@@ -8,6 +8,8 @@
 #include <capnp/dynamic.h>
 #include <capnp/orphan.h>
 #include <capnp/schema.h>
+#include <kj/exception.h>
+#include <kj/function.h>
 #include <kj/string.h>
 #include <kj/map.h>
 
@@ -24,11 +26,25 @@ struct Adapter {
   void update(capnp::DynamicStruct::Reader);
   void select(capnp::DynamicStruct::Builder);
 
+  void scan(
+    capnp::DynamicStruct::Reader key, uint prefix,
+    kj::FunctionParam<void(capnp::DynamicStruct::Reader)> func);
+  // Calls `func` for every row whose first `prefix` primary key columns equal those of `key`, in
+  // primary key order.  On a `withoutRowid` table this walks the clustered index sequentially.
+  // `func` may not start another scan() with the same prefix on this Adapter.
+
   template <typename T, capnp::Style s = capnp::style<T>()>
   class Handler;
   
   template <typename T>
   void addFieldHandler(capnp::StructSchema::Field field, Handler<T>& handler);
+  // Use `handler` for `field` in place of its default encoding.  Field handlers take precedence
+  // over the `compress`, `base64` and `hex` annotations, which take precedence over type
+  // handlers.  Handlers are resolved once, when registered, rather than per row.
+
+  template <typename T>
+  void addTypeHandler(Handler<T>& handler);
+  // Use `handler` for every column of type T that has no field handler or encoding annotation.
 
   void encode(capnp::DynamicValue::Reader value, capnp::Type type, sqlite3_stmt*, int) const;
   
@@ -43,6 +59,7 @@ private:
   
   void addFieldHandlerImpl(
     capnp::StructSchema::Field field, capnp::Type type, HandlerBase& handler);
+  void addTypeHandlerImpl(capnp::Type type, HandlerBase& handler);
 
   kj::Own<Impl> impl_;
 };
@@ -51,7 +68,39 @@ private:
 struct Adapter::HandlerBase {
   virtual void encodeBase(const Adapter& codec, capnp::DynamicValue::Reader input, sqlite3_stmt* stmt, int param) const = 0;
 
-  virtual capnp::Orphan<capnp::DynamicValue> decodeBase(const Adapter& codec, sqlite3_stmt* stmt, int param, capnp::Orphanage) const = 0;
+  virtual capnp::Orphan<capnp::DynamicValue> decodeBase(const Adapter& codec, capnp::Type, sqlite3_stmt* stmt, int col, capnp::Orphanage) const = 0;
+  // Never called for NULL columns, which decode as the field's default value.
+};
+
+template <typename T>
+class Adapter::Handler<T, capnp::Style::PRIMITIVE>: private Adapter::HandlerBase {
+public:
+  virtual void encode(
+    const Adapter& codec, T input, sqlite3_stmt* stmt, int param) const = 0;
+
+  virtual T decode(
+    const Adapter& codec, sqlite3_stmt* stmt, int col) const = 0;
+
+private:
+  void encodeBase(
+    const Adapter& codec, capnp::DynamicValue::Reader input,
+    sqlite3_stmt* stmt, int param) const override final {
+    encode(codec, input.as<T>(), stmt, param);
+  }
+
+  capnp::Orphan<capnp::DynamicValue> decodeBase(
+    const Adapter& codec, capnp::Type type,
+    sqlite3_stmt* stmt, int col, capnp::Orphanage) const override final {
+    auto value = decode(codec, stmt, col);
+    if constexpr (capnp::kind<T>() == capnp::Kind::ENUM) {
+      return capnp::DynamicEnum(type.asEnum(), static_cast<uint16_t>(value));
+    }
+    else {
+      return value;
+    }
+  }
+
+  friend class Adapter;
 };
 
 template <typename T>
@@ -84,11 +133,80 @@ inline void Adapter::addFieldHandler(capnp::StructSchema::Field field, Handler<T
   addFieldHandlerImpl(field, capnp::Type::from<T>(), handler);
 }
 
+template <typename T>
+inline void Adapter::addTypeHandler(Handler<T>& handler) {
+  addTypeHandlerImpl(capnp::Type::from<T>(), handler);
+}
+
+class Transaction {
+  // A savepoint on a connection, grouping the work of every Adapter sharing it.  The outermost
+  // Transaction on a connection commits once, on commit(); nested ones fold into their parent.
+  // Destroying a Transaction without calling commit() rolls back everything done since it began.
+
+public:
+  explicit Transaction(sqlite3* db);
+  KJ_DISALLOW_COPY(Transaction);
+  ~Transaction() noexcept;
+
+  void commit();
+  void rollback();
+
+  template <typename Func>
+  static decltype(auto) run(sqlite3* db, Func&& func, uint maxAttempts = 8);
+  // Runs `func()` inside a Transaction and commits it.  If the connection is not already in a
+  // transaction, an OVERLOADED exception (i.e. SQLITE_BUSY or SQLITE_LOCKED) rolls back and
+  // re-runs `func()` after a backoff, up to `maxAttempts` times in total.
+
+private:
+  sqlite3* db_;
+  bool done_ = false;
+
+  static void backoff(uint attempt);
+};
+
+template <typename Func>
+decltype(auto) Transaction::run(sqlite3* db, Func&& func, uint maxAttempts) {
+  // Retrying a nested transaction cannot release the locks held by its parent.
+  if (!sqlite3_get_autocommit(db)) {
+    maxAttempts = 1;
+  }
+
+  for (uint attempt = 1;; ++attempt) {
+    try {
+      Transaction txn{db};
+      if constexpr (kj::isSameType<decltype(func()), void>()) {
+	func();
+	txn.commit();
+	return;
+      }
+      else {
+	// decltype(auto) so that a reference returned by `func` is passed through, not copied.
+	decltype(auto) result = func();
+	txn.commit();
+	return result;
+      }
+    }
+    catch (const kj::Exception& e) {
+      if (e.getType() != kj::Exception::Type::OVERLOADED || attempt >= maxAttempts) {
+	throw;
+      }
+    }
+    backoff(attempt);
+  }
+}
+
+void encodeValue(capnp::DynamicValue::Reader input, capnp::Type type, sqlite3_stmt*, int param);
+capnp::Orphan<capnp::DynamicValue> decodeValue(
+  capnp::Type type, sqlite3_stmt*, int col, capnp::Orphanage);
+// The built-in encoding of each type, ignoring any handlers.  NaN floats are stored as NULL, and
+// so decode as VOID; NULL columns decode as VOID, leaving the field at its default.
+
 kj::String createStatement(capnp::StructSchema schema);
 kj::String insertStatement(capnp::StructSchema schema);
 kj::String updateStatement(capnp::StructSchema schema);
 kj::String deleteStatement(capnp::StructSchema schema);
 kj::String selectStatement(capnp::StructSchema schema);
+kj::String scanStatement(capnp::StructSchema schema, uint prefix);
 
 kj::Own<Adapter> adapt(capnp::StructSchema);
 }